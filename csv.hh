@@ -9,6 +9,27 @@
 #include <istream>
 #include <map>
 #include <memory>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <charconv>
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
 #include <assert.h>
 
 namespace csv
@@ -33,10 +54,50 @@ namespace csv
         }
     }
 
+    // FNV-1a hash, hash can be used to chain calls
+    inline std::uint64_t fnv1a(const char* data, std::size_t size, std::uint64_t hash = 14695981039346656037ULL) {
+        for (std::size_t i{}; i!=size; ++i) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
     constexpr char default_delimiter = ',';
     constexpr char default_escape_char = '\\';
+
+    // does line contains neither quotes nor escape characters?
+    inline bool is_plain_line(const std::string& line, char escape_char = default_escape_char) {
+        constexpr char quote = '"';
+        return !std::memchr(line.data(), quote, line.size())
+            && !std::memchr(line.data(), escape_char, line.size());
+    }
+
+    // split a line without quotes and escape characters, fields
+    // are the bare text between delimiters
+    inline std::vector<std::string> split_plain_line(const std::string& line, char delimiter = default_delimiter, std::size_t expected_columns = 1UL) {
+        std::vector<std::string> ans;
+        ans.reserve(expected_columns);
+        const char* begin = line.data();
+        const char* const end = begin + line.size();
+        while (auto next = static_cast<const char*>(std::memchr(begin, delimiter, end - begin))) {
+            ans.emplace_back(begin, next);
+            begin = next + 1;
+        }
+        // like split_csv_line, a trailing
+        // empty field is not reported
+        if (begin != end) {
+            ans.emplace_back(begin, end);
+        }
+        return ans;
+    }
+
     inline std::vector<std::string> split_csv_line(const std::string& line, char delimiter = default_delimiter, char escape_char = default_escape_char, std::size_t expected_columns = 1UL) {
         constexpr char quote = '"';
+        // fast path: nothing to unquote or unescape
+        if (is_plain_line(line, escape_char)) {
+            return split_plain_line(line, delimiter, expected_columns);
+        }
         // returned sequence of strings
         std::vector<std::string> ans;
         // reserve space for the
@@ -163,6 +224,23 @@ namespace csv
         return ans;
     }
 
+    // convert a field to a number, throw if it is not entirely numeric
+    template <typename T>
+    inline T parse_field(const std::string& field) {
+        T ans{};
+        auto end = field.data() + field.size();
+        auto [ptr, ec] = std::from_chars(field.data(), end, ans);
+        if (ec != std::errc() || ptr != end) {
+            throw std::runtime_error("Malformed number '" + field + "'");
+        }
+        return ans;
+    }
+
+    template <>
+    inline std::string parse_field(const std::string& field) {
+        return field;
+    }
+
     template <typename T>
     inline std::vector<std::string> cast_line(const std::vector<T>& line) {
         std::vector<std::string> ans; ans.reserve(line.size());
@@ -209,6 +287,17 @@ namespace csv
             return _data;
         }
 
+        // line.get<double>("col") parses the field in place
+        template <typename T>
+        T get(const std::string& key) const {
+            return parse_field<T>(operator[](key));
+        }
+
+        template <typename T>
+        T get(std::size_t i) const {
+            return parse_field<T>(_data.at(i));
+        }
+
         /**
          * return contained data and invalidate the object
          * To be used for extreme hogh performances
@@ -226,6 +315,268 @@ namespace csv
         }
     };
 
+    // end marker for row_iterator and batch_iterator
+    struct sentinel {};
+
+    /**
+     * Input iterator over the rows of a reader, works with any
+     * class exposing can_read() and getline(). Like
+     * std::istream_iterator the row is read on increment.
+     */
+    template <typename Reader>
+    class row_iterator
+    {
+    public:
+        // post-increment returns void, so this is not
+        // a legacy input iterator, only a C++20 one
+        using iterator_concept = std::input_iterator_tag;
+        using value_type = csv::line;
+        using difference_type = std::ptrdiff_t;
+        using pointer = csv::line*;
+        using reference = csv::line&;
+
+        row_iterator() = default;
+
+        explicit row_iterator(Reader& r)
+        : _reader{&r}
+        {
+            ++*this;
+        }
+
+        reference operator*() const {
+            return *_current;
+        }
+
+        pointer operator->() const {
+            return &*_current;
+        }
+
+        row_iterator& operator++() {
+            if (_reader->can_read()) {
+                _current.emplace(_reader->getline());
+            } else {
+                _reader = nullptr;
+                _current.reset();
+            }
+            return *this;
+        }
+
+        void operator++(int) {
+            ++*this;
+        }
+
+        friend bool operator==(const row_iterator& it, sentinel) { return !it._reader; }
+        friend bool operator==(sentinel s, const row_iterator& it) { return it == s; }
+        friend bool operator!=(const row_iterator& it, sentinel s) { return !(it == s); }
+        friend bool operator!=(sentinel s, const row_iterator& it) { return !(it == s); }
+    private:
+        Reader* _reader{};
+        // mutable so that rows can be moved out of *it
+        mutable std::optional<csv::line> _current;
+    };
+
+    /**
+     * Input iterator over batches of at most size rows, to amortize
+     * per row overhead when handing data to other pipeline stages.
+     */
+    template <typename Reader>
+    class batch_iterator
+    {
+    public:
+        // post-increment returns void, so this is not
+        // a legacy input iterator, only a C++20 one
+        using iterator_concept = std::input_iterator_tag;
+        using value_type = std::vector<csv::line>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type*;
+        using reference = value_type&;
+
+        batch_iterator() = default;
+
+        batch_iterator(Reader& r, std::size_t size)
+        : _reader{&r}, _size{size ? size : 1}
+        {
+            ++*this;
+        }
+
+        reference operator*() const {
+            return _current;
+        }
+
+        pointer operator->() const {
+            return &_current;
+        }
+
+        batch_iterator& operator++() {
+            _current = value_type();
+            _current.reserve(_size);
+            while (_current.size() != _size && _reader->can_read()) {
+                _current.push_back(_reader->getline());
+            }
+            if (_current.empty()) {
+                _reader = nullptr;
+            }
+            return *this;
+        }
+
+        void operator++(int) {
+            ++*this;
+        }
+
+        friend bool operator==(const batch_iterator& it, sentinel) { return !it._reader; }
+        friend bool operator==(sentinel s, const batch_iterator& it) { return it == s; }
+        friend bool operator!=(const batch_iterator& it, sentinel s) { return !(it == s); }
+        friend bool operator!=(sentinel s, const batch_iterator& it) { return !(it == s); }
+    private:
+        Reader* _reader{};
+        std::size_t _size{1};
+        mutable value_type _current;
+    };
+
+    // single pass [begin, end) pair usable in range-for,
+    // begin() hands over the iterator and can be called once
+    template <typename Iterator>
+    class range
+    {
+    public:
+        explicit range(Iterator begin)
+        : _begin{std::move(begin)}
+        {}
+
+        Iterator begin() {
+            assert(!_taken && "csv::range::begin() called twice");
+            _taken = true;
+            return std::move(_begin);
+        }
+
+        sentinel end() const {
+            return {};
+        }
+    private:
+        Iterator _begin;
+        bool _taken{};
+    };
+
+    // iterate over batches of rows:
+    // for (auto& batch : csv::batches(r, 1024)) ...
+    template <typename Reader>
+    inline auto batches(Reader& r, std::size_t size) {
+        return range<batch_iterator<Reader>>(batch_iterator<Reader>(r, size));
+    }
+
+    /**
+     * Bounded blocking queue to move rows or batches between
+     * threads. Producers block while the channel is full, close()
+     * wakes up consumers once all the data has been pushed.
+     */
+    template <typename T>
+    class channel
+    {
+    public:
+        class iterator;
+
+        explicit channel(std::size_t capacity = 16)
+        : _capacity{capacity ? capacity : 1}
+        {}
+
+        // return false if the channel was closed
+        bool push(T value) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _not_full.wait(lock, [this]() { return _closed || _queue.size() < _capacity; });
+            if (_closed) {
+                return false;
+            }
+            _queue.push_back(std::move(value));
+            _not_empty.notify_one();
+            return true;
+        }
+
+        // empty optional when closed and drained
+        std::optional<T> pop() {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _not_empty.wait(lock, [this]() { return _closed || !_queue.empty(); });
+            if (_queue.empty()) {
+                return std::nullopt;
+            }
+            std::optional<T> ans{std::move(_queue.front())};
+            _queue.pop_front();
+            _not_full.notify_one();
+            return ans;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+            _not_empty.notify_all();
+            _not_full.notify_all();
+        }
+
+        iterator begin() {
+            return iterator(*this);
+        }
+
+        sentinel end() const {
+            return {};
+        }
+    private:
+        std::size_t _capacity;
+        bool _closed{};
+        std::deque<T> _queue;
+        std::mutex _mutex;
+        std::condition_variable _not_empty;
+        std::condition_variable _not_full;
+    };
+
+    // consume a channel until closed
+    template <typename T>
+    class channel<T>::iterator
+    {
+    public:
+        // post-increment returns void, so this is not
+        // a legacy input iterator, only a C++20 one
+        using iterator_concept = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+        iterator() = default;
+
+        explicit iterator(channel& c)
+        : _channel{&c}
+        {
+            ++*this;
+        }
+
+        reference operator*() const {
+            return *_current;
+        }
+
+        pointer operator->() const {
+            return &*_current;
+        }
+
+        iterator& operator++() {
+            _current = _channel->pop();
+            if (!_current) {
+                _channel = nullptr;
+            }
+            return *this;
+        }
+
+        void operator++(int) {
+            ++*this;
+        }
+
+        friend bool operator==(const iterator& it, sentinel) { return !it._channel; }
+        friend bool operator==(sentinel s, const iterator& it) { return it == s; }
+        friend bool operator!=(const iterator& it, sentinel s) { return !(it == s); }
+        friend bool operator!=(sentinel s, const iterator& it) { return !(it == s); }
+    private:
+        channel* _channel{};
+        mutable std::optional<T> _current;
+    };
+
     class writer
     {
     public:
@@ -335,17 +686,28 @@ namespace csv
         }
 
         bool can_read() {
-            // reached eof
-            if (_in.eof()) {
-                return false;
-            }
-            char c;
-            if (_in >> c) {
-                _in.putback(c);
+            // first row already read to count columns
+            if (!_buffered_line.empty()) {
                 return true;
-            } else {
-                return false;
             }
+            // skip whitespace like operator>> did, peek
+            // does not extract the first data character
+            auto c = _in.peek();
+            while (c != std::istream::traits_type::eof() && std::isspace(c)) {
+                _in.get();
+                ++_position;
+                c = _in.peek();
+            }
+            return c != std::istream::traits_type::eof();
+        }
+
+        // for (auto& line : reader) ...
+        auto begin() {
+            return row_iterator<reader>(*this);
+        }
+
+        auto end() const {
+            return sentinel{};
         }
 
         // Was the header read?
@@ -380,6 +742,7 @@ namespace csv
                 if (!std::getline(_in, line)) {
                     throw csv::eof();
                 }
+                _position += line.size() + 1;
             }
         }
 
@@ -392,6 +755,12 @@ namespace csv
         auto line_count() const {
             return _line_counter - !_buffered_line.empty();
         }
+
+        // Byte offset of the last read line, relative to
+        // the stream position when the reader was built
+        auto last_offset() const {
+            return _row_offset;
+        }
     private:
         void handle_header() {
             if (this->_read_header) {
@@ -399,6 +768,7 @@ namespace csv
                 if (!std::getline(_in, line)) {
                     throw csv::eof();
                 }
+                _position += line.size() + 1;
                 _header = split_csv_line(line);
                 _line_length = _header.size();
                 _indexes = std::make_shared<std::map<std::string, int>>(std::map<std::string, int>());
@@ -441,11 +811,12 @@ namespace csv
         std::vector<std::string> getline_internal() {
             using namespace std::literals;
 
-            std::string line;
-            if (!can_read() || !std::getline(_in, line)) {
+            if (!can_read() || !std::getline(_in, _line_buffer)) {
                 throw csv::eof();
             }
-            auto data = split_csv_line(line, delimiter, escape_char, column_count());
+            _row_offset = _position;
+            _position += _line_buffer.size() + 1;
+            auto data = split_csv_line(_line_buffer, delimiter, escape_char, column_count());
             if (_line_counter == 0 && !_read_header) {
                 // if first read (header was ignored)
                 // take current line
@@ -479,6 +850,10 @@ namespace csv
         std::size_t _line_length{};
         // count the number of parsed lines
         std::size_t _line_counter{};
+        // bytes consumed from the stream
+        std::uint64_t _position{};
+        // where the last read line begins
+        std::uint64_t _row_offset{};
         // input stream
         // used to take stream ownership
         std::unique_ptr<std::istream> _input;
@@ -504,6 +879,912 @@ namespace csv
         // column number if header is not required
         // to be read
         std::vector<std::string> _buffered_line;
+        // reused by getline_internal to
+        // avoid an allocation per line
+        std::string _line_buffer;
+    };
+    /**
+     * Binary sidecar cache of a parsed .csv file.
+     *
+     * The first time a file is opened rows are parsed with
+     * csv::reader and, while being returned, their unescaped fields
+     * are written into "<file>.csvcache", each row as its size, the
+     * lengths of its fields and their bytes. The cache is kept only if
+     * the whole file is read. Later opens validate the cache against
+     * the source size, modification time and a hash of its first and
+     * last bytes and, if still valid, read it in large blocks and
+     * slice fields out of them without tokenizing the text again.
+     *
+     * The .csv remains the source of truth: a stale, corrupted or
+     * unwritable cache is silently ignored and the text is parsed.
+     * If the source was modified less than racy_window before the
+     * cache was written, its mtime cannot tell a later edit apart,
+     * so the whole source is hashed as well. Edits keeping size and
+     * mtime of an older file (touch -r, rsync -t) in the middle of it
+     * are not detected: remove the cache after such edits.
+     */
+    class cached_reader
+    {
+    public:
+        cached_reader(const std::string& path, bool include_header = true, long long skip_lines = 0, bool skip_duplicate = true)
+        : cached_reader(path, path + ".csvcache", include_header, skip_lines, skip_duplicate)
+        {}
+
+        cached_reader(const std::string& path, const std::string& cache_path, bool include_header = true, long long skip_lines = 0, bool skip_duplicate = true)
+        : _path{path}, _read_header{include_header}, _skip_lines{skip_lines}, _skip_duplicate{skip_duplicate}
+        {
+            fingerprint();
+            if (!load(cache_path)) {
+                switch_to_text();
+                start_store(cache_path);
+            }
+        }
+
+        // without this a string literal as cache_path
+        // would be converted to bool include_header
+        cached_reader(const std::string& path, const char* cache_path, bool include_header = true, long long skip_lines = 0, bool skip_duplicate = true)
+        : cached_reader(path, std::string(cache_path), include_header, skip_lines, skip_duplicate)
+        {}
+
+        // a partially written cache is discarded
+        ~cached_reader() {
+            if (_store) {
+                _store.reset();
+                std::remove(_store_path.c_str());
+            }
+        }
+
+        bool can_read() {
+            if (_text) {
+                auto ans = _text->can_read();
+                if (!ans && _store) {
+                    finish_store();
+                }
+                return ans;
+            }
+            return _next != _rows;
+        }
+
+        auto begin() {
+            return row_iterator<cached_reader>(*this);
+        }
+
+        auto end() const {
+            return sentinel{};
+        }
+
+        // Was the header read?
+        auto has_header() const {
+            return _read_header;
+        }
+
+        // Are rows being read from the cache instead of the text?
+        auto from_cache() const {
+            return !_text;
+        }
+
+        // retrive const reference to header column names
+        const auto& header() const {
+            if (!_read_header) {
+                throw std::logic_error("Header has not been previously read");
+            }
+            return _header;
+        }
+
+        auto header_string() const {
+            return merge_csv_line(header());
+        }
+
+        line getline() {
+            if (!can_read()) {
+                throw csv::eof();
+            }
+            if (!_text) {
+                std::vector<std::string> data;
+                if (read_row(data)) {
+                    ++_next;
+                    if (_read_header) {
+                        return csv::line(_indexes, std::move(data));
+                    }
+                    return csv::line(std::move(data));
+                }
+                // cache corrupted after the header,
+                // continue from the same row of the text
+                switch_to_text();
+            }
+            ++_next;
+            auto ans = _text->getline();
+            if (_store) {
+                store_row(ans.data());
+            }
+            return ans;
+        }
+
+        // Number of columns available in the .csv
+        auto column_count() const {
+            return _line_length;
+        }
+
+        // Return the number of data line read
+        auto line_count() const {
+            return _next;
+        }
+    private:
+        static constexpr char magic[8] = {'C', 'S', 'V', 'C', 'A', 'C', 'H', '4'};
+        // bytes hashed at both ends of the source file
+        static constexpr std::uint64_t sample_size = 64 * 1024;
+        // cache file bytes read at once
+        static constexpr std::size_t block_size = 1024 * 1024;
+        // sources modified this close to the cache
+        // creation are checked by content too
+        static constexpr auto racy_window = std::chrono::seconds(2);
+
+        // fixed size part of the cache file
+        struct cache_header {
+            char magic[sizeof(cached_reader::magic)];
+            std::uint64_t source_size;
+            std::int64_t source_mtime;
+            // hash of first and last sample_size bytes
+            std::uint64_t source_hash;
+            // hash of the whole source, only if racy
+            std::uint64_t content_hash;
+            std::uint8_t racy;
+            std::int64_t skip_lines;
+            std::uint8_t include_header;
+            std::uint8_t skip_duplicate;
+            char delimiter;
+            char escape_char;
+            std::uint64_t line_length;
+            // fields per stored row
+            std::uint64_t width;
+            // stored rows, header included
+            std::uint64_t rows;
+            // bytes following the header
+            std::uint64_t data_size;
+        };
+
+        // collect size, mtime and sampled hash of the source file
+        void fingerprint() {
+            std::ifstream in(_path, std::ios::binary);
+            if (!in) {
+                throw std::runtime_error("Error opening file " + _path);
+            }
+            _source_size = std::filesystem::file_size(_path);
+            auto mtime = std::filesystem::last_write_time(_path);
+            _source_mtime = mtime.time_since_epoch().count();
+            _racy = std::filesystem::file_time_type::clock::now() - mtime < racy_window;
+            std::string sample(std::min(_source_size, sample_size), '\0');
+            in.read(sample.data(), sample.size());
+            _source_hash = fnv1a(sample.data(), in.gcount());
+            if (_source_size > sample_size) {
+                in.seekg(-static_cast<std::streamoff>(sample.size()), std::ios::end);
+                in.read(sample.data(), sample.size());
+                _source_hash = fnv1a(sample.data(), in.gcount(), _source_hash);
+            }
+        }
+
+        // hash of the whole source
+        std::uint64_t content_hash() const {
+            std::ifstream in(_path, std::ios::binary);
+            std::string chunk(sample_size, '\0');
+            auto ans = fnv1a(nullptr, 0);
+            while (in.read(chunk.data(), chunk.size()) || in.gcount()) {
+                ans = fnv1a(chunk.data(), in.gcount(), ans);
+            }
+            return ans;
+        }
+
+        cache_header make_header() const {
+            cache_header h{};
+            std::copy(std::begin(magic), std::end(magic), h.magic);
+            h.source_size = _source_size;
+            h.source_mtime = _source_mtime;
+            h.source_hash = _source_hash;
+            h.skip_lines = _skip_lines;
+            h.include_header = _read_header;
+            h.skip_duplicate = _skip_duplicate;
+            h.delimiter = default_delimiter;
+            h.escape_char = default_escape_char;
+            return h;
+        }
+
+        // open a valid cache and read its header row,
+        // return false on any mismatch
+        bool load(const std::string& cache_path) {
+            auto in = std::make_unique<std::ifstream>(cache_path, std::ios::binary);
+            if (!*in) {
+                return false;
+            }
+            cache_header h;
+            if (!in->read(reinterpret_cast<char*>(&h), sizeof(h))) {
+                return false;
+            }
+            auto expected = make_header();
+            std::error_code ec;
+            auto cache_size = std::filesystem::file_size(cache_path, ec);
+            // header fields are checked against the file size
+            // before being used to allocate anything
+            if (ec || !std::equal(std::begin(magic), std::end(magic), h.magic)
+                || h.source_size != expected.source_size
+                || h.source_mtime != expected.source_mtime
+                || h.source_hash != expected.source_hash
+                || h.skip_lines != expected.skip_lines
+                || h.include_header != expected.include_header
+                || h.skip_duplicate != expected.skip_duplicate
+                || h.delimiter != expected.delimiter
+                || h.escape_char != expected.escape_char
+                || cache_size != sizeof(h) + h.data_size
+                // each row takes at least its size and one byte per field
+                || !h.width || h.width > h.data_size
+                || !h.rows || h.rows > h.data_size / (sizeof(std::uint32_t) + h.width)
+                || (h.racy && h.content_hash != content_hash())) {
+                return false;
+            }
+            _cache = std::move(in);
+            _buffer.resize(block_size);
+            _begin = _end = 0;
+            _line_length = h.line_length;
+            _width = h.width;
+            _remaining = h.data_size;
+            _rows = h.rows;
+            _next = 0;
+            if (_read_header) {
+                if (!read_row(_header)) {
+                    _cache.reset();
+                    return false;
+                }
+                make_indexes();
+                --_rows;
+            }
+            return true;
+        }
+
+        // make at least n bytes available in the buffer
+        bool fill(std::size_t n) {
+            if (_end - _begin >= n) {
+                return true;
+            }
+            // keep unread bytes
+            std::copy(_buffer.begin() + _begin, _buffer.begin() + _end, _buffer.begin());
+            _end -= _begin;
+            _begin = 0;
+            if (n > _buffer.size()) {
+                _buffer.resize(n);
+            }
+            _cache->read(_buffer.data() + _end, _buffer.size() - _end);
+            _end += _cache->gcount();
+            return _end >= n;
+        }
+
+        // read the next stored row, false if the cache is corrupted
+        bool read_row(std::vector<std::string>& data) {
+            std::uint32_t size;
+            if (sizeof(size) > _remaining || !fill(sizeof(size))) {
+                return false;
+            }
+            std::memcpy(&size, _buffer.data() + _begin, sizeof(size));
+            if (size > _remaining - sizeof(size) || !fill(sizeof(size) + size)) {
+                return false;
+            }
+            _remaining -= sizeof(size) + size;
+            const char* p = _buffer.data() + _begin + sizeof(size);
+            const char* const end = p + size;
+            _begin += sizeof(size) + size;
+            // field lengths as LEB128 varints
+            _lengths.resize(_width);
+            for (auto& l : _lengths) {
+                l = 0;
+                for (unsigned shift{}; ; shift += 7) {
+                    if (p == end || shift > 28) {
+                        return false;
+                    }
+                    auto byte = static_cast<unsigned char>(*p++);
+                    l |= static_cast<std::uint32_t>(byte & 0x7f) << shift;
+                    if (!(byte & 0x80)) {
+                        break;
+                    }
+                }
+            }
+            data.clear();
+            data.reserve(_width);
+            for (auto l : _lengths) {
+                if (l > static_cast<std::size_t>(end - p)) {
+                    return false;
+                }
+                data.emplace_back(p, l);
+                p += l;
+            }
+            return p == end;
+        }
+
+        // serve rows parsing the text, skipping
+        // those already read from the cache
+        void switch_to_text() {
+            _cache.reset();
+            _text.reset();
+            _text_in = std::make_unique<std::ifstream>(_path);
+            if (!*_text_in) {
+                throw std::runtime_error("Error opening file " + _path);
+            }
+            _text = std::make_unique<csv::reader>(*_text_in, _read_header, _skip_lines, _skip_duplicate);
+            _line_length = _text->column_count();
+            if (_read_header) {
+                _header = _text->header();
+                make_indexes();
+            }
+            for (std::size_t i{}; i!=_next; ++i) {
+                _text->getline();
+            }
+        }
+
+        // begin writing the cache into a temporary file, rows
+        // are appended by getline, if the cache cannot be
+        // written the text is simply read
+        void start_store(const std::string& cache_path) {
+            _cache_path = cache_path;
+            // unique, concurrent readers may be storing too
+            std::random_device rd;
+            _store_path = cache_path + "." + std::to_string(rd()) + ".tmp";
+            _store = std::make_unique<std::ofstream>(_store_path, std::ios::binary | std::ios::trunc);
+            _stored = make_header();
+            if (_racy) {
+                _stored.racy = true;
+                _stored.content_hash = content_hash();
+            }
+            _stored.line_length = _line_length;
+            // sizes are written by finish_store
+            _store->write(reinterpret_cast<const char*>(&_stored), sizeof(_stored));
+            if (_read_header) {
+                store_row(_header);
+            }
+            if (_store && !*_store) {
+                abort_store();
+            }
+        }
+
+        // rows are assembled in _row_buffer to issue a
+        // single write each: size of the row, varint
+        // lengths of the fields and then their bytes
+        void store_row(const std::vector<std::string>& data) {
+            _stored.width = data.size();
+            ++_stored.rows;
+            _row_buffer.assign(sizeof(std::uint32_t), '\0');
+            for (const auto& s : data) {
+                auto l = s.size();
+                if (l > UINT32_MAX) {
+                    // not representable, no cache
+                    abort_store();
+                    return;
+                }
+                while (l >= 0x80) {
+                    _row_buffer += static_cast<char>((l & 0x7f) | 0x80);
+                    l >>= 7;
+                }
+                _row_buffer += static_cast<char>(l);
+            }
+            for (const auto& s : data) {
+                _row_buffer += s;
+            }
+            if (_row_buffer.size() - sizeof(std::uint32_t) > UINT32_MAX) {
+                abort_store();
+                return;
+            }
+            std::uint32_t size = _row_buffer.size() - sizeof(std::uint32_t);
+            std::memcpy(_row_buffer.data(), &size, sizeof(size));
+            _stored.data_size += _row_buffer.size();
+            _store->write(_row_buffer.data(), _row_buffer.size());
+        }
+
+        // all rows written, move the cache in place
+        // so readers never see a partial one
+        void finish_store() {
+            _store->seekp(0);
+            _store->write(reinterpret_cast<const char*>(&_stored), sizeof(_stored));
+            bool ok = static_cast<bool>(_store->flush());
+            _store.reset();
+            std::error_code ec;
+            if (ok) {
+                std::filesystem::rename(_store_path, _cache_path, ec);
+            }
+            if (!ok || ec) {
+                std::remove(_store_path.c_str());
+            }
+        }
+
+        void abort_store() {
+            _store.reset();
+            std::remove(_store_path.c_str());
+        }
+
+        void make_indexes() {
+            _indexes = std::make_shared<std::map<std::string, int>>();
+            for (std::size_t i{}; i!=_header.size(); ++i) {
+                _indexes->emplace(_header[i], i);
+            }
+        }
+
+        std::string _path;
+        // cache key
+        std::uint64_t _source_size{};
+        std::int64_t _source_mtime{};
+        std::uint64_t _source_hash{};
+        // source modified just now?
+        bool _racy{};
+        // reader configuration, part of the key too
+        bool _read_header = true;
+        long long _skip_lines{};
+        bool _skip_duplicate = true;
+        // number of field for single line as
+        // seen by csv::reader
+        std::size_t _line_length{};
+        // number of stored fields per row
+        std::size_t _width{};
+        // open cache, read one block at a time
+        std::unique_ptr<std::ifstream> _cache;
+        // unread cache bytes are [_begin, _end) of _buffer
+        std::vector<char> _buffer;
+        std::size_t _begin{};
+        std::size_t _end{};
+        // cache bytes not yet consumed
+        std::uint64_t _remaining{};
+        // field lengths of the current row
+        std::vector<std::uint32_t> _lengths;
+        // fallback on the text if the cache is not usable
+        std::unique_ptr<std::ifstream> _text_in;
+        std::unique_ptr<csv::reader> _text;
+        // cache being written while reading the text
+        std::unique_ptr<std::ofstream> _store;
+        std::string _store_path;
+        std::string _cache_path;
+        cache_header _stored{};
+        std::string _row_buffer;
+        // number of data rows and next one to be returned
+        std::size_t _rows{};
+        std::size_t _next{};
+        std::shared_ptr<std::map<std::string, int>> _indexes;
+        std::vector<std::string> _header;
+    };
+    /**
+     * Compare two .csv files with the same header by key columns
+     * and report rows added, removed or changed in the new one.
+     *
+     * Inputs are streamed and only key, digest of the fields and
+     * byte offset of each row are kept, full rows are read back
+     * from disk when they have to be written. If one file fits in
+     * the memory limit a hash join is built on it, otherwise both
+     * indexes are hash partitioned into temporary files and each
+     * partition is sorted and merged by a pool of threads.
+     */
+    class differ
+    {
+    public:
+        // counters of the last run
+        struct stats {
+            std::size_t added{};
+            std::size_t removed{};
+            std::size_t changed{};
+            std::size_t unchanged{};
+        };
+
+        differ(const std::string& old_path, const std::string& new_path, const std::vector<std::string>& key_columns)
+        : _paths{old_path, new_path}, _key_columns{key_columns}
+        {
+            if (_key_columns.empty()) {
+                throw std::logic_error("At least one key column is required");
+            }
+        }
+
+        // approximate amount of memory used for indexes and
+        // partition buffers, shared among all threads. Limits
+        // needing more than max_partitions are not honoured
+        auto& set_memory_limit(std::uint64_t bytes) {
+            _memory_limit = bytes ? bytes : 1;
+            return *this;
+        }
+
+        // threads used to merge partitions
+        auto& set_threads(unsigned threads) {
+            _threads = threads ? threads : 1;
+            return *this;
+        }
+
+        // rows are written as found in the new file,
+        // except removed ones taken from the old file.
+        // Writers are never used concurrently but the
+        // order of rows is not specified
+        stats run(writer& added, writer& removed, writer& changed) {
+            _outputs[added_row] = &added;
+            _outputs[removed_row] = &removed;
+            _outputs[changed_row] = &changed;
+            _stats = stats();
+            check_headers();
+            estimate sizes[2]{sample(old_side), sample(new_side)};
+            auto build_old = join_size(sizes[old_side], sizes[new_side]);
+            auto build_new = join_size(sizes[new_side], sizes[old_side]);
+            side build = build_old <= build_new ? old_side : new_side;
+            if (std::min(build_old, build_new) <= _memory_limit) {
+                hash_join(build, sizes[build].rows);
+            } else {
+                partitioned_join(entries_size(sizes[old_side]) + entries_size(sizes[new_side]));
+            }
+            return _stats;
+        }
+    private:
+        // rows read to estimate index sizes
+        static constexpr std::uint64_t sample_rows = 1024;
+        // temporary files open at once per input
+        static constexpr std::size_t max_partitions = 512;
+        // bounds of the write buffer of each partition file
+        static constexpr std::size_t min_buffer = 512;
+        static constexpr std::size_t max_buffer = 8192;
+
+        enum side { old_side, new_side };
+        enum kind { added_row, removed_row, changed_row };
+
+        // what is kept in memory for each row
+        struct entry {
+            std::string key;
+            std::uint64_t digest;
+            std::uint64_t offset;
+        };
+
+        // value of the hash join index
+        struct slot {
+            std::uint64_t digest;
+            std::uint64_t offset;
+            bool matched;
+        };
+
+        // rows of a file and average length of their key
+        struct estimate {
+            std::uint64_t rows;
+            std::uint64_t key_size;
+        };
+
+        // heap memory of a key, none if the
+        // small string buffer is enough
+        static std::uint64_t key_heap(std::uint64_t key_size) {
+            return key_size < sizeof(std::string) ? 0 : key_size + 1 + 2 * sizeof(void*);
+        }
+
+        // unordered_map node (value, next pointer, cached hash,
+        // malloc overhead), bucket pointer and unmatched offset
+        static std::uint64_t hash_size(const estimate& e) {
+            auto node = sizeof(std::pair<const std::string, slot>) + sizeof(void*) + sizeof(std::size_t) + 2 * sizeof(void*);
+            return e.rows * (node + sizeof(void*) + sizeof(std::uint64_t) + key_heap(e.key_size));
+        }
+
+        // set node (key, next pointer, cached hash, malloc
+        // overhead) and bucket pointer, if no probed key matches
+        static std::uint64_t unmatched_size(const estimate& e) {
+            auto node = sizeof(std::string) + sizeof(void*) + sizeof(std::size_t) + 2 * sizeof(void*);
+            return e.rows * (node + sizeof(void*) + key_heap(e.key_size));
+        }
+
+        // memory of hash_join building on one side
+        // and probing the other one
+        static std::uint64_t join_size(const estimate& build, const estimate& probe) {
+            return hash_size(build) + unmatched_size(probe);
+        }
+
+        // entries held by partitioned_join
+        static std::uint64_t entries_size(const estimate& e) {
+            return e.rows * (sizeof(entry) + key_heap(e.key_size));
+        }
+
+        // count rows of small files, extrapolate from the
+        // average length of the first ones otherwise
+        estimate sample(side s) const {
+            auto in = open(s);
+            csv::reader r(in, true, 0, false);
+            std::uint64_t rows{}, key_bytes{}, first{};
+            while (r.can_read()) {
+                auto e = make_entry(r.getline().access_and_invalidate(), r.last_offset());
+                if (!rows) {
+                    first = e.offset;
+                } else if (rows == sample_rows) {
+                    auto row_size = std::max<std::uint64_t>((e.offset - first) / rows, 1);
+                    rows = (std::filesystem::file_size(_paths[s]) - first + row_size - 1) / row_size;
+                    break;
+                }
+                ++rows;
+                key_bytes += e.key.size();
+            }
+            return estimate{rows, rows ? key_bytes / std::min(rows, sample_rows) : 0};
+        }
+
+        // deletes temporary files on exit
+        struct temp_file {
+            std::string path;
+
+            temp_file() {
+                std::random_device rd;
+                auto name = "csv-diff-" + std::to_string(rd()) + std::to_string(rd()) + ".tmp";
+                path = (std::filesystem::temp_directory_path() / name).string();
+            }
+
+            temp_file(const temp_file&) = delete;
+            temp_file& operator=(const temp_file&) = delete;
+
+            ~temp_file() {
+                std::remove(path.c_str());
+            }
+        };
+
+        std::ifstream open(side s) const {
+            std::ifstream in(_paths[s], std::ios::binary);
+            if (!in) {
+                throw std::runtime_error("Error opening file " + _paths[s]);
+            }
+            return in;
+        }
+
+        void check_headers() {
+            std::vector<std::string> headers[2];
+            for (auto s : {old_side, new_side}) {
+                auto in = open(s);
+                headers[s] = csv::reader(in, true, 0, false).header();
+            }
+            if (headers[old_side] != headers[new_side]) {
+                throw std::runtime_error("Mismatching headers in " + _paths[old_side] + " and " + _paths[new_side]);
+            }
+            _key_indexes.clear();
+            for (const auto& column : _key_columns) {
+                auto it = std::find(headers[old_side].begin(), headers[old_side].end(), column);
+                if (it == headers[old_side].end()) {
+                    throw std::runtime_error("Missing key column '" + column + "'");
+                }
+                _key_indexes.push_back(it - headers[old_side].begin());
+            }
+        }
+
+        entry make_entry(const std::vector<std::string>& data, std::uint64_t offset) const {
+            std::vector<std::string> key;
+            key.reserve(_key_indexes.size());
+            for (auto i : _key_indexes) {
+                key.push_back(data[i]);
+            }
+            // hash size and content of each field so
+            // that ["ab", ""] and ["a", "b"] differ
+            std::uint64_t digest = fnv1a(nullptr, 0);
+            for (const auto& field : data) {
+                std::uint64_t size = field.size();
+                digest = fnv1a(reinterpret_cast<const char*>(&size), sizeof(size), digest);
+                digest = fnv1a(field.data(), field.size(), digest);
+            }
+            return entry{merge_csv_line(key), digest, offset};
+        }
+
+        // call f(entry, data) for each row of a file
+        template <typename F>
+        void scan(side s, F&& f) const {
+            auto in = open(s);
+            csv::reader r(in, true, 0, false);
+            while (r.can_read()) {
+                auto data = r.getline().access_and_invalidate();
+                f(make_entry(data, r.last_offset()), data);
+            }
+        }
+
+        static std::vector<std::string> read_row(std::ifstream& in, std::uint64_t offset) {
+            std::string line;
+            in.clear();
+            in.seekg(offset);
+            if (!std::getline(in, line)) {
+                throw csv::eof();
+            }
+            return split_csv_line(line);
+        }
+
+        void emit(kind k, const std::vector<std::string>& data) {
+            std::lock_guard<std::mutex> lock(_output_mutex);
+            _outputs[k]->write_line(data);
+            switch (k) {
+            case added_row:   ++_stats.added; break;
+            case removed_row: ++_stats.removed; break;
+            case changed_row: ++_stats.changed; break;
+            }
+        }
+
+        void count_unchanged(std::size_t n) {
+            std::lock_guard<std::mutex> lock(_output_mutex);
+            _stats.unchanged += n;
+        }
+
+        static void duplicate_key(const std::string& key) {
+            throw std::runtime_error("Duplicate key " + key);
+        }
+
+        // build an index of the smaller file and probe it
+        // streaming the other one
+        void hash_join(side build, std::uint64_t rows) {
+            side probe = build == old_side ? new_side : old_side;
+            // row only in the probe side
+            kind missing = probe == new_side ? added_row : removed_row;
+            // row only in the build side
+            kind unmatched = build == new_side ? added_row : removed_row;
+            std::unordered_map<std::string, slot> index;
+            // avoid rehashing while building
+            index.reserve(rows);
+            scan(build, [&](entry&& e, const std::vector<std::string>&) {
+                // key is not moved if already present
+                if (!index.try_emplace(std::move(e.key), slot{e.digest, e.offset, false}).second) {
+                    duplicate_key(e.key);
+                }
+            });
+            auto build_in = open(build);
+            std::size_t unchanged{};
+            // probed keys not in the index, to detect
+            // duplicates as partitioned_join does
+            std::unordered_set<std::string> missing_keys;
+            scan(probe, [&](entry&& e, const std::vector<std::string>& data) {
+                auto it = index.find(e.key);
+                if (it == index.end()) {
+                    if (!missing_keys.insert(e.key).second) {
+                        duplicate_key(e.key);
+                    }
+                    emit(missing, data);
+                    return;
+                }
+                if (it->second.matched) {
+                    duplicate_key(e.key);
+                }
+                it->second.matched = true;
+                if (it->second.digest == e.digest) {
+                    ++unchanged;
+                } else {
+                    emit(changed_row, probe == new_side ? data : read_row(build_in, it->second.offset));
+                }
+            });
+            count_unchanged(unchanged);
+            // visit unmatched rows in file order
+            std::vector<std::uint64_t> offsets;
+            for (const auto& [key, s] : index) {
+                if (!s.matched) {
+                    offsets.push_back(s.offset);
+                }
+            }
+            std::sort(offsets.begin(), offsets.end());
+            for (auto offset : offsets) {
+                emit(unmatched, read_row(build_in, offset));
+            }
+        }
+
+        static void write_entry(std::ofstream& out, const entry& e) {
+            std::uint64_t size = e.key.size();
+            out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+            out.write(e.key.data(), e.key.size());
+            out.write(reinterpret_cast<const char*>(&e.digest), sizeof(e.digest));
+            out.write(reinterpret_cast<const char*>(&e.offset), sizeof(e.offset));
+        }
+
+        static std::vector<entry> read_entries(const std::string& path, std::uint64_t count) {
+            std::vector<entry> ans;
+            ans.reserve(count);
+            std::ifstream in(path, std::ios::binary);
+            std::uint64_t size;
+            while (in.read(reinterpret_cast<char*>(&size), sizeof(size))) {
+                entry e{std::string(size, '\0'), 0, 0};
+                in.read(e.key.data(), size);
+                in.read(reinterpret_cast<char*>(&e.digest), sizeof(e.digest));
+                in.read(reinterpret_cast<char*>(&e.offset), sizeof(e.offset));
+                if (!in) {
+                    throw std::runtime_error("Corrupted temporary file " + path);
+                }
+                ans.push_back(std::move(e));
+            }
+            return ans;
+        }
+
+        // spread both indexes over partitions small enough
+        // to fit in memory, then sort-merge them in parallel.
+        // Each thread holds the entries of one partition of
+        // both files, so the limit is split among threads
+        void partitioned_join(std::uint64_t index_size) {
+            auto threads = _threads;
+            std::size_t partitions = index_size / std::max<std::uint64_t>(_memory_limit / threads, 1) + 1;
+            if (partitions > max_partitions) {
+                // fewer threads need fewer partitions
+                threads = static_cast<unsigned>(std::clamp<std::uint64_t>(max_partitions * _memory_limit / index_size, 1, _threads));
+                partitions = std::min<std::uint64_t>(index_size / std::max<std::uint64_t>(_memory_limit / threads, 1) + 1, max_partitions);
+            }
+            partitions = std::max<std::size_t>(partitions, threads);
+            std::vector<temp_file> files[2]{std::vector<temp_file>(partitions), std::vector<temp_file>(partitions)};
+            std::vector<std::uint64_t> counts[2]{std::vector<std::uint64_t>(partitions), std::vector<std::uint64_t>(partitions)};
+            // write buffers of partition files count too
+            auto buffer_size = std::clamp<std::size_t>(_memory_limit / partitions, min_buffer, max_buffer);
+            std::vector<char> buffers(partitions * buffer_size);
+            for (auto s : {old_side, new_side}) {
+                std::vector<std::ofstream> outs(partitions);
+                for (std::size_t p{}; p!=partitions; ++p) {
+                    // must be set before open
+                    outs[p].rdbuf()->pubsetbuf(buffers.data() + p * buffer_size, buffer_size);
+                    outs[p].open(files[s][p].path, std::ios::binary | std::ios::trunc);
+                    if (!outs[p]) {
+                        throw std::runtime_error("Error opening temporary file " + files[s][p].path);
+                    }
+                }
+                scan(s, [&](entry&& e, const std::vector<std::string>&) {
+                    auto p = fnv1a(e.key.data(), e.key.size()) % partitions;
+                    write_entry(outs[p], e);
+                    ++counts[s][p];
+                });
+                for (auto& out : outs) {
+                    if (!out.flush()) {
+                        throw std::runtime_error("Error writing temporary file");
+                    }
+                }
+            }
+            std::atomic<std::size_t> next{};
+            std::exception_ptr error;
+            std::mutex error_mutex;
+            auto worker = [&]() {
+                try {
+                    auto old_in = open(old_side);
+                    auto new_in = open(new_side);
+                    for (auto p = next++; p < partitions; p = next++) {
+                        merge(read_entries(files[old_side][p].path, counts[old_side][p]), read_entries(files[new_side][p].path, counts[new_side][p]), old_in, new_in);
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    // stop other workers
+                    next = partitions;
+                }
+            };
+            std::vector<std::thread> pool;
+            for (unsigned i{}; i!=threads; ++i) {
+                pool.emplace_back(worker);
+            }
+            for (auto& t : pool) {
+                t.join();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        void merge(std::vector<entry>&& old_entries, std::vector<entry>&& new_entries, std::ifstream& old_in, std::ifstream& new_in) {
+            auto by_key = [](const entry& a, const entry& b) { return a.key < b.key; };
+            auto same_key = [](const entry& a, const entry& b) { return a.key == b.key; };
+            for (auto* entries : {&old_entries, &new_entries}) {
+                std::sort(entries->begin(), entries->end(), by_key);
+                auto it = std::adjacent_find(entries->begin(), entries->end(), same_key);
+                if (it != entries->end()) {
+                    duplicate_key(it->key);
+                }
+            }
+            std::size_t unchanged{};
+            auto o = old_entries.begin(), n = new_entries.begin();
+            while (o != old_entries.end() || n != new_entries.end()) {
+                if (n == new_entries.end() || (o != old_entries.end() && o->key < n->key)) {
+                    emit(removed_row, read_row(old_in, o++->offset));
+                } else if (o == old_entries.end() || n->key < o->key) {
+                    emit(added_row, read_row(new_in, n++->offset));
+                } else {
+                    if (o->digest == n->digest) {
+                        ++unchanged;
+                    } else {
+                        emit(changed_row, read_row(new_in, n->offset));
+                    }
+                    ++o; ++n;
+                }
+            }
+            count_unchanged(unchanged);
+        }
+
+        std::string _paths[2];
+        std::vector<std::string> _key_columns;
+        // position of key columns in the header
+        std::vector<std::size_t> _key_indexes;
+        std::uint64_t _memory_limit{256ULL << 20};
+        unsigned _threads{std::max(std::thread::hardware_concurrency(), 1U)};
+        // one writer per kind of row, guarded by _output_mutex
+        writer* _outputs[3]{};
+        std::mutex _output_mutex;
+        stats _stats;
     };
 } // namespace csv
 
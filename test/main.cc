@@ -5,6 +5,7 @@
 #include <sstream>
 #include <cstdio>
 #include <random>
+#include <thread>
 
 constexpr auto input = R"("2018-08-01-00:44:59","NATAS31-GISU-30","itna2ex01019.omnitel.it","022987f8-b505-4acf-8b7c-6761f2c93a81","","","","","","","","","","","","","0.0","1.0","0.0","","0.0","","","0.0","3145728.0","","","","0.0","","6592.36376953125","","","","0.0","","","","0.0","","0.0","0.0","","","0.0","","","","100.0","","","","0.0","","","","","","","","","","","","","","0.0","","","","","","","","0.0","","","","3145728.0","","","","","","","","","-3145728.0","","0.00390625","","","","","0.0","","","","0.0","","0.00390625","-6592.36376953125","","0.0","3.0","","","","0.0","","","0.0","","","0.0","-6592.36376953125","","","","","","","","","","","","","83.0","","","","","","","","","","","","","","","","97.0","","","","","","100.0","0.0","","","1.0","","0.0","","0.0","0.0039088064804673195","","","","","0.0","","","100.0","","","","0.0","","0.0","","","","","","","","0.0","-1.0","0.0","0.0","","","","","","","0.0","","100.0","","1.0","","","","","","","","","","0.0","","","","","","0.00390625","","","0.0","","","","0.0","0.0","","0.0","-3145728.0","","","","0.0","","","","","17.0","","","","","","","0.0","","","","0.0","","","","","","","0.0","","","51.0","","","","","","","0.0","1.0","","","","0.0","100.0","","","","0.0","","","0.0","","","83.0","","","0.0","","","","","","","","","","0.0","","0.10573741048574448","","1.0","","","","","","","","","","","","","0.0","","","","","","","","","","","","","","3.694293260574341","","","1.0","","","","","","","","0.0","100.0","","","0.0","","","","","6592.36376953125","","","","","")";
 
@@ -228,3 +229,245 @@ tester t8([](){
     std::cout << "Parsing successfull" << std::endl;
 });
 
+
+// binary sidecar cache: first open parses, second one loads
+tester t9([](){
+    using namespace std::literals::string_literals;
+    auto file = "data.csv"s;
+    auto cache = (std::filesystem::temp_directory_path() / "data.csv.csvcache").string();
+    std::remove(cache.c_str());
+    std::ifstream fin(file);
+    if (!fin) {
+        panic("Error opening file"s + file);
+    }
+    csv::reader r(fin);
+    std::vector<std::vector<std::string>> expected;
+    while (r.can_read()) {
+        expected.push_back(r.getline().access_and_invalidate());
+    }
+    // first open parses the text and stores the cache
+    for (bool cached : {false, true}) {
+        csv::cached_reader c(file, cache);
+        assert_or_panic(c.from_cache() == cached, "Unexpected cache status"s);
+        assert_or_panic(c.header() == r.header(), "Mismatch on header"s);
+        for (const auto& row : expected) {
+            assert_or_panic(c.getline().data() == row, "Mismatch on cached line "s + std::to_string(c.line_count()));
+        }
+        assert_or_panic(!c.can_read(), "Too many cached lines"s);
+    }
+    // a cache built with a different configuration must be ignored,
+    // a partially read file does not replace it
+    {
+        csv::cached_reader c(file, cache, false);
+        assert_or_panic(!c.from_cache(), "Stale cache used"s);
+        assert_or_panic(c.getline().data() == r.header(), "Header expected as first line"s);
+    }
+    assert_or_panic(csv::cached_reader(file, cache).from_cache(), "Cache replaced by partial read"s);
+    // a C string is still taken as cache path
+    std::remove(cache.c_str());
+    {
+        csv::cached_reader c(file, cache.c_str());
+        for (auto& line : c) {
+            (void)line;
+        }
+    }
+    assert_or_panic(std::filesystem::exists(cache) && !std::filesystem::exists(file + ".csvcache"), "Wrong cache path"s);
+    // a corrupted size of the last row ("23092","857": size,
+    // two length bytes and eight of data) and a truncated
+    // cache fall back to the text
+    auto size = std::filesystem::file_size(cache);
+    {
+        std::fstream f(cache, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(size - 14);
+        f.write(std::string(4, '\xff').data(), 4);
+    }
+    for (bool truncate : {false, true}) {
+        if (truncate) {
+            std::filesystem::resize_file(cache, size / 2);
+        }
+        csv::cached_reader c(file, cache.c_str());
+        assert_or_panic(c.from_cache() != truncate, "Unexpected cache status"s);
+        for (const auto& row : expected) {
+            assert_or_panic(c.getline().data() == row, "Mismatch on line "s + std::to_string(c.line_count()));
+        }
+        assert_or_panic(!c.can_read(), "Too many lines"s);
+        assert_or_panic(!c.from_cache(), "Corruption not detected"s);
+    }
+    std::remove(cache.c_str());
+    std::cout << "Cache successfull" << std::endl;
+});
+
+// range interface and batches moved between threads
+tester t10([](){
+    using namespace std::literals::string_literals;
+    auto file = "data.csv"s;
+    std::ifstream fin(file);
+    if (!fin) {
+        panic("Error opening file"s + file);
+    }
+    std::vector<std::vector<std::string>> expected;
+    {
+        csv::reader r(fin);
+        for (auto& line : r) {
+            expected.push_back(line.data());
+        }
+        assert_or_panic(r.line_count() == expected.size(), "Mismatch on line count"s);
+    }
+    fin.clear(); fin.seekg(0);
+    csv::reader r(fin);
+    csv::channel<std::vector<csv::line>> ch(2);
+    // failures are rethrown by the main thread
+    std::exception_ptr error;
+    std::thread producer([&]() {
+        try {
+            for (auto& batch : csv::batches(r, 7)) {
+                assert_or_panic(batch.size() <= 7, "Batch too big"s);
+                ch.push(std::move(batch));
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        ch.close();
+    });
+    std::size_t i{};
+    try {
+        for (auto& batch : ch) {
+            for (auto& line : batch) {
+                assert_or_panic(i < expected.size() && line.data() == expected[i], "Mismatch on line "s + std::to_string(i));
+                ++i;
+            }
+        }
+    } catch (...) {
+        // unblock the producer before leaving
+        ch.close();
+        producer.join();
+        throw;
+    }
+    producer.join();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    assert_or_panic(i == expected.size(), "Missing lines"s);
+    // lines with only whitespace are skipped
+    for (auto text : {"a,b\n1,2\n  \n"s, "a,b\n1,2\n \n3,4\n"s}) {
+        std::istringstream in(text);
+        csv::reader r(in);
+        std::ptrdiff_t n{};
+        for (auto& line : r) {
+            assert_or_panic(line.size() == 2, "Mismatch on line size"s);
+            ++n;
+        }
+        assert_or_panic(n == std::count(text.begin(), text.end(), ',') - 1, "Mismatch on line count"s);
+    }
+    std::cout << "Pipeline successfull" << std::endl;
+});
+
+// plain lines take the fast path and match the quoted ones
+tester t11([](){
+    using namespace std::literals::string_literals;
+    std::ifstream quoted("data.csv"), plain("data-no-quotes.csv");
+    if (!quoted || !plain) {
+        panic("Error opening files"s);
+    }
+    csv::reader q(quoted), p(plain);
+    assert_or_panic(q.header() == p.header(), "Mismatch on header"s);
+    while (q.can_read()) {
+        auto a = q.getline(), b = p.getline();
+        assert_or_panic(a.data() == b.data(), "Mismatch on line "s + std::to_string(p.line_count()));
+        assert_or_panic(b.get<int>("col1") == std::stoi(a["col1"]), "Mismatch on parsed number"s);
+    }
+    // same corner cases of the general parser
+    using v = std::vector<std::string>;
+    assert_or_panic(csv::split_plain_line(""s) == v{}, "Mismatch on empty line"s);
+    assert_or_panic(csv::split_plain_line(","s) == v{""}, "Mismatch on single delimiter"s);
+    assert_or_panic(csv::split_plain_line("a,"s) == v{"a"}, "Mismatch on trailing delimiter"s);
+    assert_or_panic(csv::split_plain_line("a,,b"s) == v{"a", "", "b"}, "Mismatch on empty field"s);
+    // quotes found mid stream fall back to the general path
+    std::istringstream in("a,b\n1,2.5\n\"3\",\"x\\\"y\"\n");
+    csv::reader r(in);
+    auto l = r.getline();
+    assert_or_panic(l.get<int>(0) == 1 && l.get<double>("b") == 2.5, "Mismatch on plain line"s);
+    l = r.getline();
+    assert_or_panic(l["a"] == "3" && l["b"] == "x\"y", "Mismatch on quoted line"s);
+    bool thrown = false;
+    try {
+        l.get<int>("b");
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert_or_panic(thrown, "Malformed number not detected"s);
+    std::cout << "Fast path successfull" << std::endl;
+});
+
+// diff by key with both hash join and partitioned sort-merge
+tester t12([](){
+    using namespace std::literals::string_literals;
+    using rows = std::vector<std::vector<std::string>>;
+    auto dir = std::filesystem::temp_directory_path();
+    auto old_file = (dir / "csv-diff-old.csv").string(), new_file = (dir / "csv-diff-new.csv").string();
+    {
+        std::ofstream o(old_file), n(new_file);
+        csv::writer wo(o, std::vector<std::string>{"id", "name", "value"});
+        csv::writer wn(n, std::vector<std::string>{"id", "name", "value"});
+        for (int i{}; i!=200; ++i) {
+            // 0-9 removed
+            if (i >= 10) {
+                // multiples of 7 changed
+                wn.write_line(std::vector<std::string>{std::to_string(i), "n" + std::to_string(i), i % 7 ? "x" : "y"});
+            }
+            wo.write_line(std::vector<std::string>{std::to_string(i), "n" + std::to_string(i), "x"});
+        }
+        // added
+        wn.write_line(std::vector<std::string>{"1000", "new,\"one\"", ""});
+    }
+    rows removed, added, changed;
+    for (int i{}; i!=10; ++i) {
+        removed.push_back({std::to_string(i), "n" + std::to_string(i), "x"});
+    }
+    for (int i{14}; i<200; i+=7) {
+        changed.push_back({std::to_string(i), "n" + std::to_string(i), "y"});
+    }
+    added.push_back({"1000", "new,\"one\"", ""});
+    auto parse = [](const std::string& text) {
+        std::istringstream in(text);
+        rows ans;
+        csv::reader r(in, false);
+        for (auto& line : r) {
+            ans.push_back(line.data());
+        }
+        std::sort(ans.begin(), ans.end());
+        return ans;
+    };
+    for (std::uint64_t memory : {1ULL << 20, 256ULL}) {
+        std::ostringstream a, r, c;
+        csv::writer wa(a, 3), wr(r, 3), wc(c, 3);
+        auto stats = csv::differ(old_file, new_file, {"id"}).set_memory_limit(memory).set_threads(3).run(wa, wr, wc);
+        assert_or_panic(stats.unchanged == 190 - changed.size(), "Mismatch on unchanged count"s);
+        assert_or_panic(stats.added == added.size() && parse(a.str()) == added, "Mismatch on added rows"s);
+        assert_or_panic(stats.removed == removed.size() && parse(r.str()) == removed, "Mismatch on removed rows"s);
+        std::sort(changed.begin(), changed.end());
+        assert_or_panic(stats.changed == changed.size() && parse(c.str()) == changed, "Mismatch on changed rows"s);
+    }
+    // a duplicated key missing from the other file, in the larger
+    // one, so that the hash join finds it while probing
+    {
+        std::ofstream o(old_file, std::ios::app);
+        csv::writer wo(o, 3);
+        wo.write_line(std::vector<std::string>{"9999", "x", ""});
+        wo.write_line(std::vector<std::string>{"9999", "y", ""});
+    }
+    for (std::uint64_t memory : {1ULL << 20, 256ULL}) {
+        std::ostringstream a, r, c;
+        csv::writer wa(a, 3), wr(r, 3), wc(c, 3);
+        bool thrown = false;
+        try {
+            csv::differ(old_file, new_file, {"id"}).set_memory_limit(memory).set_threads(3).run(wa, wr, wc);
+        } catch (const std::runtime_error& e) {
+            thrown = std::string(e.what()).find("Duplicate key") != std::string::npos;
+        }
+        assert_or_panic(thrown, "Duplicate key not detected with memory limit "s + std::to_string(memory));
+    }
+    std::remove(old_file.c_str());
+    std::remove(new_file.c_str());
+    std::cout << "Diff successfull" << std::endl;
+});